@@ -4,9 +4,12 @@ include $(CLEAR_VARS)
 ifeq ($(TARGET_USE_DISKINSTALLER),true)
 
 LOCAL_SRC_FILES := \
-	installer.c
+	installer.c \
+	ext2_image.c
 
-LOCAL_C_INCLUDES := $(LOCAL_PATH)/libdiskconfig
+LOCAL_C_INCLUDES := \
+	$(LOCAL_PATH)/libdiskconfig \
+	external/e2fsprogs/lib
 
 LOCAL_CFLAGS := -O2 -g -W -Wall -Werror
 
@@ -14,6 +17,9 @@ LOCAL_MODULE := diskinstaller
 LOCAL_MODULE_TAGS := optional
 
 LOCAL_STATIC_LIBRARIES := $(TARGET_DISK_CONFIG_LIB)
+LOCAL_SHARED_LIBRARIES := \
+	libext2fs \
+	libext2_com_err
 LOCAL_SYSTEM_SHARED_LIBRARIES := \
 	libdiskconfig \
 	libcutils \
@@ -31,11 +31,35 @@
 /* give us some room */
 #define EXTRA_LBAS      100
 
+/* chunk size used when streaming the image out */
+#define STREAM_BUF_SIZE (1024 * 1024)
+
 static struct pf_map {
     struct part_info *pinfo;
     const char *filename;
 } part_file_map[MAX_NUM_PARTS] = { {0, 0} };
 
+/* Anything that ends up in the output stream, in disk offset order: either
+ * a partition table fragment (data != NULL), or a partition payload file. */
+struct stream_extent {
+    loff_t offset;
+    uint32_t len;
+    const uint8_t *data;
+    const char *filename;
+};
+
+struct stream_ctx {
+    int out_fd;
+    int base_fd;
+    loff_t pos;
+    char *buf;
+    char *scratch;
+    int test;
+};
+
+/* where informational messages go; stderr when the image goes to stdout */
+static FILE *info_fp;
+
 static int
 usage(void)
 {
@@ -43,7 +67,18 @@ usage(void)
             "\nusage: editdisklbl <options> part1=file1 [part2=file2,...]\n"
             "Where options can be one of:\n"
             "\t\t-l <layout conf>  -- The image layout config file.\n"
-            "\t\t-i <image file>   -- The image file to edit.\n"
+            "\t\t-i <image file>   -- The image file to edit. With -o, the\n"
+            "\t\t                     (optional) base image whose contents\n"
+            "\t\t                     fill everything outside the partition\n"
+            "\t\t                     table and partition payloads.\n"
+            "\t\t-o <out file>     -- Write the complete disk image as one\n"
+            "\t\t                     sequential stream to <out file>\n"
+            "\t\t                     ('-' for stdout) instead of editing\n"
+            "\t\t                     the image file in place. The output\n"
+            "\t\t                     is identical to the in-place result\n"
+            "\t\t                     and, like it, ends after the last\n"
+            "\t\t                     payload rather than at the full\n"
+            "\t\t                     disk size.\n"
             "\t\t-t                -- Test mode (optional)\n"
             "\t\t-v                -- Be verbose\n"
             "\t\t-h                -- This message (optional)\n"
@@ -53,15 +88,15 @@ usage(void)
 
 static int
 parse_args(int argc, char *argv[], struct disk_info **dinfo, int *test,
-           int *verbose)
+           int *verbose, char **img_file, char **out_file)
 {
     char *layout_conf = NULL;
-    char *img_file = NULL;
     struct stat filestat;
+    struct stat out_stat;
     int x;
     int update_lba = 0;
 
-    while ((x = getopt (argc, argv, "vthl:i:")) != EOF) {
+    while ((x = getopt (argc, argv, "vthl:i:o:")) != EOF) {
         switch (x) {
             case 'h':
                 return usage();
@@ -72,7 +107,10 @@ parse_args(int argc, char *argv[], struct disk_info **dinfo, int *test,
                 *test = 1;
                 break;
             case 'i':
-                img_file = optarg;
+                *img_file = optarg;
+                break;
+            case 'o':
+                *out_file = optarg;
                 break;
             case 'v':
                 *verbose = 1;
@@ -83,11 +121,14 @@ parse_args(int argc, char *argv[], struct disk_info **dinfo, int *test,
         }
     }
 
-    if (!img_file || !layout_conf) {
+    if ((!*img_file && !*out_file) || !layout_conf) {
         fprintf(stderr, "Image filename and configuration file are required\n");
         return usage();
     }
 
+    if (*out_file && !strcmp(*out_file, "-"))
+        info_fp = stderr;
+
     /* we'll need to parse the command line later for partition-file
      * mappings, so make sure there's at least something there */
     if (optind >= argc) {
@@ -95,20 +136,39 @@ parse_args(int argc, char *argv[], struct disk_info **dinfo, int *test,
         return usage();
     }
 
-    if (stat(img_file, &filestat)) {
-        perror("Cannot stat image file");
-        return 1;
+    if (*img_file) {
+        if (stat(*img_file, &filestat)) {
+            perror("Cannot stat image file");
+            return 1;
+        }
+
+        /* make sure we don't screw up and write to a block device on the
+         * host and wedge things. I just don't trust myself. */
+        if (!S_ISREG(filestat.st_mode)) {
+            fprintf(stderr, "This program should only be used on regular files.");
+            return 1;
+        }
     }
 
-    /* make sure we don't screw up and write to a block device on the host
-     * and wedge things. I just don't trust myself. */
-    if (!S_ISREG(filestat.st_mode)) {
-        fprintf(stderr, "This program should only be used on regular files.");
-        return 1;
+    /* same goes for the output stream. Pipes and regular files are fine. */
+    if (*out_file && strcmp(*out_file, "-") && !stat(*out_file, &out_stat)) {
+        if (S_ISBLK(out_stat.st_mode)) {
+            fprintf(stderr, "Refusing to stream the image to a block device.\n");
+            return 1;
+        }
+
+        /* the output gets truncated before the base image is read */
+        if (*img_file && out_stat.st_dev == filestat.st_dev &&
+            out_stat.st_ino == filestat.st_ino) {
+            fprintf(stderr, "The base image and output must be different "
+                    "files.\n");
+            return 1;
+        }
     }
 
     /* load the disk layout file */
-    if (!(*dinfo = load_diskconfig(layout_conf, img_file))) {
+    if (!(*dinfo = load_diskconfig(layout_conf,
+                                   *img_file ? *img_file : *out_file))) {
         fprintf(stderr, "Errors encountered while loading disk conf file %s",
                 layout_conf);
         return 1;
@@ -157,28 +217,308 @@ parse_args(int argc, char *argv[], struct disk_info **dinfo, int *test,
         if (update_lba)
             (*dinfo)->num_lba += 
                     ((uint64_t)pinfo->len_kb * 1024) / (*dinfo)->sect_size;
-        printf("Updated %s length to be %uKB\n", pinfo->name, pinfo->len_kb);
+        fprintf(info_fp, "Updated %s length to be %uKB\n", pinfo->name,
+                pinfo->len_kb);
+    }
+
+    return 0;
+}
+
+static int
+cmp_extents(const void *a, const void *b)
+{
+    const struct stream_extent *ea = a;
+    const struct stream_extent *eb = b;
+
+    if (ea->offset < eb->offset)
+        return -1;
+    return ea->offset > eb->offset;
+}
+
+static int
+out_write(struct stream_ctx *ctx, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t rv;
+
+    ctx->pos += len;
+    if (ctx->test)
+        return 0;
+
+    while (len) {
+        if ((rv = write(ctx->out_fd, p, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error writing image stream");
+            return -1;
+        }
+        p += rv;
+        len -= rv;
+    }
+    return 0;
+}
+
+/* Read the next 'len' bytes of the base image into 'buf'. Past the end of
+ * the base image (or without one), the disk is all zeros. */
+static int
+base_read(struct stream_ctx *ctx, char *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t rv;
+
+    while (ctx->base_fd >= 0 && done < len) {
+        if ((rv = read(ctx->base_fd, buf + done, len - done)) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error reading base image");
+            return -1;
+        } else if (rv == 0) {
+            close(ctx->base_fd);
+            ctx->base_fd = -1;
+        }
+        done += rv;
+    }
+    memset(buf + done, 0, len - done);
+    return 0;
+}
+
+/* emit the base image (or zeros) up to 'offset' */
+static int
+stream_gap(struct stream_ctx *ctx, loff_t offset)
+{
+    while (ctx->pos < offset) {
+        size_t chunk = STREAM_BUF_SIZE;
+
+        if ((loff_t)chunk > offset - ctx->pos)
+            chunk = (size_t)(offset - ctx->pos);
+        if (base_read(ctx, ctx->buf, chunk) || out_write(ctx, ctx->buf, chunk))
+            return -1;
     }
+    return 0;
+}
 
+/* emit whatever is left of the base image past the last extent */
+static int
+stream_base_tail(struct stream_ctx *ctx)
+{
+    ssize_t rv;
+
+    while (ctx->base_fd >= 0) {
+        if ((rv = read(ctx->base_fd, ctx->buf, STREAM_BUF_SIZE)) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("Error reading base image");
+            return -1;
+        } else if (rv == 0) {
+            close(ctx->base_fd);
+            ctx->base_fd = -1;
+        } else if (out_write(ctx, ctx->buf, rv))
+            return -1;
+    }
     return 0;
 }
 
+static int
+stream_payload(struct stream_ctx *ctx, const char *filename)
+{
+    ssize_t rv;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    for (;;) {
+        if ((rv = read(fd, ctx->buf, STREAM_BUF_SIZE)) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error reading %s: %s\n", filename,
+                    strerror(errno));
+            break;
+        } else if (rv == 0) {
+            close(fd);
+            return 0;
+        }
+
+        /* keep the base image in step with the output */
+        if (base_read(ctx, ctx->scratch, rv) ||
+            out_write(ctx, ctx->buf, rv))
+            break;
+    }
+
+    close(fd);
+    return -1;
+}
+
+/* Produce the whole disk image front to back in a single pass: the base
+ * image, with the partition table entries and the partition payloads laid
+ * over it in offset order, and zeros wherever neither has anything. The
+ * stream ends at the end of the base image or of the last extent,
+ * whichever is later, so it is byte for byte what editing a copy of the
+ * base image in place would have produced. This never seeks, so the output can be a pipe into a compressor or hasher.
+ * If 'image_fd' is valid, the image goes there instead of to 'out_file'. */
+static int
+stream_disk_image(struct disk_info *dinfo, const char *base_file,
+                  const char *out_file, int image_fd, int test)
+{
+    struct write_list *wlist = NULL;
+    struct write_list *wl;
+    struct stream_extent *extents = NULL;
+    struct stream_ctx ctx;
+    loff_t disk_size;
+    int num_extents = 0;
+    int func_ret = 1;
+    int cnt;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.out_fd = -1;
+    ctx.base_fd = -1;
+    ctx.test = test;
+
+    if (dinfo->scheme != PART_SCHEME_MBR) {
+        fprintf(stderr, "Only MBR disk layouts can be streamed.\n");
+        return 1;
+    }
+
+    /* this computes the partition start LBAs, and gives us the table
+     * entries that apply_disk_config() would have written */
+    if (!(wlist = config_mbr(dinfo))) {
+        fprintf(stderr, "Could not configure the partition table!\n");
+        return 1;
+    }
+
+    for (cnt = 0, wl = wlist; wl; wl = wl->next)
+        ++cnt;
+    if (!(extents = calloc(cnt + MAX_NUM_PARTS, sizeof(*extents)))) {
+        fprintf(stderr, "Cannot allocate memory for stream extents\n");
+        goto fail;
+    }
+
+    for (wl = wlist; wl; wl = wl->next) {
+        extents[num_extents].offset = wl->offset;
+        extents[num_extents].len = wl->len;
+        extents[num_extents++].data = wl->data;
+    }
+    for (cnt = 0; cnt < MAX_NUM_PARTS && part_file_map[cnt].pinfo; ++cnt) {
+        extents[num_extents].offset =
+            (loff_t)part_file_map[cnt].pinfo->start_lba * dinfo->sect_size;
+        extents[num_extents++].filename = part_file_map[cnt].filename;
+    }
+    qsort(extents, num_extents, sizeof(*extents), cmp_extents);
+
+    if (!(ctx.buf = malloc(STREAM_BUF_SIZE)) ||
+        !(ctx.scratch = malloc(STREAM_BUF_SIZE))) {
+        fprintf(stderr, "Cannot allocate stream buffers\n");
+        goto fail;
+    }
+
+    if (base_file && (ctx.base_fd = open(base_file, O_RDONLY)) < 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", base_file, strerror(errno));
+        goto fail;
+    }
+
+    if (!test) {
+        if (image_fd >= 0)
+            ctx.out_fd = image_fd;
+        else if ((ctx.out_fd = open(out_file, O_WRONLY | O_CREAT | O_TRUNC,
+                                    0644)) < 0) {
+            fprintf(stderr, "Cannot open %s: %s\n", out_file, strerror(errno));
+            goto fail;
+        }
+    }
+
+    fprintf(info_fp, "Streaming disk image to %s\n", out_file);
+    for (cnt = 0; cnt < num_extents; ++cnt) {
+        struct stream_extent *ext = &extents[cnt];
+
+        if (ext->offset < ctx.pos) {
+            fprintf(stderr, "Data at offset %lld overlaps preceding data\n",
+                    (long long)ext->offset);
+            goto fail;
+        }
+
+        if (stream_gap(&ctx, ext->offset))
+            goto fail;
+
+        if (ext->data) {
+            if (base_read(&ctx, ctx.scratch, ext->len) ||
+                out_write(&ctx, ext->data, ext->len))
+                goto fail;
+        } else if (stream_payload(&ctx, ext->filename)) {
+            fprintf(stderr, "Could not stream image %s\n", ext->filename);
+            goto fail;
+        }
+    }
+
+    disk_size = (loff_t)dinfo->num_lba * dinfo->sect_size;
+    if (ctx.pos > disk_size) {
+        fprintf(stderr, "Images do not fit in the disk (%lld > %lld)\n",
+                (long long)ctx.pos, (long long)disk_size);
+        goto fail;
+    }
+    if (stream_base_tail(&ctx))
+        goto fail;
+
+    fprintf(info_fp, "Wrote %lld bytes.\n", (long long)ctx.pos);
+    func_ret = 0;
+
+fail:
+    if (ctx.out_fd >= 0 && ctx.out_fd != image_fd)
+        close(ctx.out_fd);
+    if (ctx.base_fd >= 0)
+        close(ctx.base_fd);
+    free(ctx.scratch);
+    free(ctx.buf);
+    free(extents);
+    wlist_free(wlist);
+    return func_ret;
+}
+
 int
 main(int argc, char *argv[])
 {
     struct disk_info *dinfo = NULL;
+    char *img_file = NULL;
+    char *out_file = NULL;
+    int image_fd = -1;
     int test = 0;
     int verbose = 0;
     int cnt;
+    int rv;
 
-    if (parse_args(argc, argv, &dinfo, &test, &verbose))
+    info_fp = stdout;
+    if (parse_args(argc, argv, &dinfo, &test, &verbose, &img_file, &out_file))
         return 1;
 
+    /* When the image goes to stdout, keep the real stdout for the image
+     * only and point fd 1 at stderr, so that anything printf()'d from here
+     * on (including libdiskconfig's dump) can't end up in the image. */
+    if (out_file && !strcmp(out_file, "-")) {
+        fflush(stdout);
+        if ((image_fd = dup(STDOUT_FILENO)) < 0 ||
+            dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            perror("Cannot redirect stdout");
+            return 1;
+        }
+    }
+
     if (verbose)
         dump_disk_config(dinfo);
 
     if (test)
-        printf("Test mode enabled. Actions will not be committed to disk!\n");
+        fprintf(info_fp,
+                "Test mode enabled. Actions will not be committed to disk!\n");
+
+    if (out_file) {
+        rv = stream_disk_image(dinfo, img_file, out_file, image_fd, test);
+        fflush(stdout);
+        if (image_fd >= 0 && close(image_fd)) {
+            perror("Error closing image stream");
+            return 1;
+        }
+        return rv;
+    }
 
     if (apply_disk_config(dinfo, test)) {
         fprintf(stderr, "Could not apply disk configuration!\n");
@@ -0,0 +1,395 @@
+/* bootable/diskinstaller/ext2_image.c
+ *
+ * Copyright 2026, The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "installer"
+
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include <cutils/log.h>
+#include <ext2fs/ext2fs.h>
+
+#include "installer.h"
+
+/* largest single read/write we issue while copying a run of used blocks */
+#define COPY_BUF_SIZE       (1024 * 1024)
+
+#define SYSFS_BLOCK_DIR     "/sys/class/block"
+
+/* With uninit_bg, libext2fs hands back an all-zero bitmap for groups
+ * flagged BLOCK_UNINIT, even though their backup superblock, group
+ * descriptors, reserved GDT blocks and possibly bitmaps/inode table are
+ * in use. Mark those explicitly so nothing treats them as free. */
+static void
+mark_uninit_group_blocks(ext2_filsys fs)
+{
+    struct ext2_group_desc *gd;
+    dgrp_t i;
+    blk_t blk;
+    unsigned int j;
+
+    if (!EXT2_HAS_RO_COMPAT_FEATURE(fs->super,
+                                    EXT4_FEATURE_RO_COMPAT_GDT_CSUM))
+        return;
+
+    for (i = 0; i < fs->group_desc_count; ++i) {
+        gd = &fs->group_desc[i];
+        if (!(gd->bg_flags & EXT2_BG_BLOCK_UNINIT))
+            continue;
+
+        ext2fs_reserve_super_and_bgd(fs, i, fs->block_map);
+
+        if (gd->bg_block_bitmap)
+            ext2fs_mark_block_bitmap(fs->block_map, gd->bg_block_bitmap);
+        if (gd->bg_inode_bitmap)
+            ext2fs_mark_block_bitmap(fs->block_map, gd->bg_inode_bitmap);
+        for (blk = gd->bg_inode_table, j = 0;
+             blk && j < fs->inode_blocks_per_group; ++blk, ++j)
+            ext2fs_mark_block_bitmap(fs->block_map, blk);
+    }
+
+    /* the fs is open read-only, don't try to write these back */
+    ext2fs_unmark_bb_dirty(fs);
+}
+
+/* Open the ext2/3/4 filesystem at 'path' read-only, and load a block
+ * bitmap that can be trusted to cover all allocated blocks. */
+static int
+open_ext2_fs(const char *path, ext2_filsys *ret_fs)
+{
+    ext2_filsys fs;
+    errcode_t err;
+
+    if ((err = ext2fs_open(path, 0, 0, 0, unix_io_manager, &fs))) {
+        ALOGE("Cannot open %s as an ext2 filesystem (err=%ld)", path,
+             (long)err);
+        return 1;
+    }
+
+    if ((err = ext2fs_read_block_bitmap(fs))) {
+        ALOGE("Cannot read block bitmaps from %s (err=%ld)", path,
+             (long)err);
+        ext2fs_close(fs);
+        return 1;
+    }
+
+    mark_uninit_group_blocks(fs);
+    *ret_fs = fs;
+    return 0;
+}
+
+static int
+block_in_use(ext2_filsys fs, blk_t blk)
+{
+    /* anything before the first data block (boot sector, and the
+     * superblock on 1k block filesystems) is not covered by the bitmap,
+     * but we always want it. */
+    if (blk < fs->super->s_first_data_block)
+        return 1;
+    return ext2fs_test_block_bitmap(fs->block_map, blk) != 0;
+}
+
+/* Find the next run of blocks, starting at or after '*blk', that are all
+ * used (or all free, if 'used' is 0). On return, the run spans
+ * [*run_start, *blk). Returns 0 once there are no more such runs. */
+static int
+next_block_run(ext2_filsys fs, int used, blk_t *blk, blk_t *run_start)
+{
+    blk_t num_blocks = fs->super->s_blocks_count;
+
+    while (*blk < num_blocks && block_in_use(fs, *blk) != used)
+        ++*blk;
+    if (*blk >= num_blocks)
+        return 0;
+
+    *run_start = *blk;
+    while (*blk < num_blocks && block_in_use(fs, *blk) == used)
+        ++*blk;
+    return 1;
+}
+
+static int
+copy_range(int src_fd, int dst_fd, char *buf, loff_t offset, uint64_t len)
+{
+    while (len) {
+        size_t chunk = len > COPY_BUF_SIZE ? COPY_BUF_SIZE : (size_t)len;
+        size_t done;
+        ssize_t rv;
+
+        rv = pread64(src_fd, buf, chunk, offset);
+        if (rv != (ssize_t)chunk) {
+            ALOGE("Short read from image at offset %llu (errno=%d)",
+                 (unsigned long long)offset, errno);
+            return -1;
+        }
+
+        for (done = 0; done < chunk; done += rv) {
+            rv = pwrite64(dst_fd, buf + done, chunk - done, offset + done);
+            if (rv < 0) {
+                if (errno == EINTR) {
+                    rv = 0;
+                    continue;
+                }
+                ALOGE("Error writing to destination at offset %llu (errno=%d)",
+                     (unsigned long long)(offset + done), errno);
+                return -1;
+            }
+        }
+
+        offset += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+/* Copy an ext2/3/4 image to 'dst', transferring only the blocks that the
+ * source filesystem's block bitmaps mark as allocated (this includes all
+ * of the superblocks, group descriptors, bitmaps, inode tables and the
+ * journal). Free blocks on the destination are left untouched, since
+ * nothing in the filesystem references their contents. */
+int
+write_ext2_image_sparse(const char *dst, const char *src, int test)
+{
+    ext2_filsys fs = NULL;
+    blk_t blk;
+    blk_t run_start;
+    blk_t num_blocks;
+    uint32_t blk_size;
+    uint64_t used = 0;
+    int src_fd = -1;
+    int dst_fd = -1;
+    char *buf = NULL;
+    int func_ret = 1;
+
+    if (open_ext2_fs(src, &fs))
+        return 1;
+
+    blk_size = EXT2_BLOCK_SIZE(fs->super);
+    num_blocks = fs->super->s_blocks_count;
+
+    ALOGI("Sparse copy of %s -> %s (%u blocks of %u bytes, %u free)", src, dst,
+         num_blocks, blk_size, fs->super->s_free_blocks_count);
+
+    if (!test) {
+        loff_t dst_size;
+
+        if ((src_fd = open(src, O_RDONLY)) < 0) {
+            ALOGE("Cannot open image %s (errno=%d)", src, errno);
+            goto fail;
+        }
+
+        if ((dst_fd = open(dst, O_WRONLY)) < 0) {
+            ALOGE("Cannot open destination %s (errno=%d)", dst, errno);
+            goto fail;
+        }
+
+        dst_size = lseek64(dst_fd, 0, SEEK_END);
+        if (dst_size < (loff_t)num_blocks * blk_size) {
+            ALOGE("Destination %s is too small for image %s (%lld < %llu)",
+                 dst, src, (long long)dst_size,
+                 (unsigned long long)num_blocks * blk_size);
+            goto fail;
+        }
+
+        if (!(buf = malloc(COPY_BUF_SIZE))) {
+            ALOGE("Cannot allocate copy buffer");
+            goto fail;
+        }
+    }
+
+    blk = 0;
+    while (next_block_run(fs, 1, &blk, &run_start)) {
+        used += (uint64_t)(blk - run_start) * blk_size;
+        if (test)
+            continue;
+
+        if (copy_range(src_fd, dst_fd, buf, (loff_t)run_start * blk_size,
+                       (uint64_t)(blk - run_start) * blk_size))
+            goto fail;
+    }
+
+    if (!test && fsync(dst_fd)) {
+        ALOGE("Error syncing %s (errno=%d)", dst, errno);
+        goto fail;
+    }
+
+    ALOGI("Wrote %llu of %llu bytes from %s (skipped %llu unallocated)",
+         (unsigned long long)used,
+         (unsigned long long)num_blocks * blk_size, src,
+         (unsigned long long)num_blocks * blk_size - used);
+    func_ret = 0;
+
+fail:
+    if (buf)
+        free(buf);
+    if (dst_fd >= 0)
+        close(dst_fd);
+    if (src_fd >= 0)
+        close(src_fd);
+    ext2fs_close(fs);
+    return func_ret;
+}
+
+/* Read a numeric sysfs attribute of block device 'dev'. Partitions don't
+ * have a request queue of their own, so with 'try_parent' set, fall back
+ * to the attribute of the parent disk. Returns 0 on success. */
+static int
+read_block_attr(const char *dev, const char *attr, int try_parent,
+                uint64_t *val)
+{
+    static const char *fmts[] = {
+        SYSFS_BLOCK_DIR "/%s/%s",
+        SYSFS_BLOCK_DIR "/%s/../%s",
+    };
+    const char *name;
+    char path[256];
+    unsigned long long tmp;
+    unsigned int i;
+    FILE *fp;
+    int rv;
+
+    name = strrchr(dev, '/');
+    name = name ? name + 1 : dev;
+
+    for (i = 0; i < (try_parent ? 2U : 1U); ++i) {
+        snprintf(path, sizeof(path), fmts[i], name, attr);
+        if (!(fp = fopen(path, "r")))
+            continue;
+        rv = fscanf(fp, "%llu", &tmp);
+        fclose(fp);
+        if (rv != 1)
+            return -1;
+        *val = tmp;
+        return 0;
+    }
+
+    return -1;
+}
+
+/* Issue a BLKDISCARD for [start, end) of the partition, after shrinking it
+ * inwards to 'align' boundaries on the underlying disk. 'part_start' is
+ * the byte offset of the partition on that disk. Returns the number of
+ * bytes discarded, or -1. */
+static int64_t
+discard_range(int fd, uint64_t start, uint64_t end, uint64_t part_start,
+              uint64_t align)
+{
+    uint64_t range[2];
+
+    start = (part_start + start + align - 1) / align * align - part_start;
+    end = (part_start + end) / align * align - part_start;
+    if (end <= start)
+        return 0;
+
+    range[0] = start;
+    range[1] = end - start;
+    if (ioctl(fd, BLKDISCARD, &range))
+        return -1;
+    return (int64_t)range[1];
+}
+
+/* Walk the block bitmaps of the ext2/3/4 filesystem on 'dev' and discard
+ * every run of free blocks, so that the underlying flash starts out with
+ * clean free space. Adjacent free blocks are coalesced into a single
+ * request. The number of bytes discarded is returned in 'discarded'. A
+ * device without discard support is not an error. */
+int
+discard_ext2_free_blocks(const char *dev, uint64_t *discarded)
+{
+    ext2_filsys fs = NULL;
+    struct stat filestat;
+    blk_t blk;
+    blk_t run_start;
+    uint32_t blk_size;
+    uint64_t max_bytes;
+    uint64_t align;
+    uint64_t part_start;
+    int64_t rv;
+    int fd = -1;
+    int func_ret = 1;
+
+    *discarded = 0;
+
+    if ((fd = open(dev, O_WRONLY)) < 0) {
+        ALOGE("Cannot open %s (errno=%d)", dev, errno);
+        return 1;
+    }
+
+    if (fstat(fd, &filestat) || !S_ISBLK(filestat.st_mode)) {
+        ALOGW("%s is not a block device, not discarding free space", dev);
+        close(fd);
+        return 0;
+    }
+
+    if (read_block_attr(dev, "queue/discard_max_bytes", 1, &max_bytes) ||
+        !max_bytes) {
+        ALOGI("%s does not support discard, skipping", dev);
+        close(fd);
+        return 0;
+    }
+
+    /* the granularity is a property of the whole disk, so alignment has to
+     * be computed relative to the start of the disk, not the partition */
+    if (read_block_attr(dev, "queue/discard_granularity", 1, &align))
+        align = 0;
+    if (read_block_attr(dev, "start", 0, &part_start))
+        part_start = 0;
+    part_start *= 512;
+
+    if (open_ext2_fs(dev, &fs)) {
+        close(fd);
+        return 1;
+    }
+
+    blk_size = EXT2_BLOCK_SIZE(fs->super);
+    if (align < blk_size)
+        align = blk_size;
+
+    blk = 0;
+    while (next_block_run(fs, 0, &blk, &run_start)) {
+        rv = discard_range(fd, (uint64_t)run_start * blk_size,
+                           (uint64_t)blk * blk_size, part_start, align);
+        if (rv < 0) {
+            if (errno == EOPNOTSUPP) {
+                ALOGI("%s does not support discard, skipping", dev);
+                func_ret = 0;
+            } else
+                ALOGE("BLKDISCARD failed on %s (errno=%d)", dev, errno);
+            goto fail;
+        }
+        *discarded += rv;
+    }
+
+    ALOGI("Discarded %llu bytes of free space on %s",
+         (unsigned long long)*discarded, dev);
+    func_ret = 0;
+
+fail:
+    ext2fs_close(fs);
+    close(fd);
+    return func_ret;
+}
@@ -41,6 +41,11 @@
 #define TUNE2FS_BIN    "/system/bin/tune2fs"
 #define RESIZE2FS_BIN  "/system/bin/resize2fs"
 
+/* ext filesystems written by this run, for the final discard pass (-D) */
+static int discard_free_space;
+static char *ext_part_devs[MAX_NUM_PARTS];
+static int num_ext_part_devs;
+
 static int
 usage(void)
 {
@@ -54,6 +59,8 @@ usage(void)
     fprintf(stderr, "\t-p <path> - Path to device that should be mounted"
                     " to /data.\n");
     fprintf(stderr, "\t-t        - Test mode. Don't write anything to disk.\n");
+    fprintf(stderr, "\t-D        - Discard the free space of every installed"
+                    " ext filesystem when done.\n");
     return 1;
 }
 
@@ -135,13 +142,109 @@ do_fsck(const char *dst, int force)
     return 0;
 }
 
+/* Only an optimization, so failing to record a partition just means it
+ * won't get discarded. */
+static void
+remember_ext_part(const char *dev)
+{
+    int x;
+
+    if (!discard_free_space)
+        return;
+
+    for (x = 0; x < num_ext_part_devs; ++x) {
+        if (!strcmp(ext_part_devs[x], dev))
+            return;
+    }
+
+    if (num_ext_part_devs >= MAX_NUM_PARTS) {
+        ALOGW("Too many ext partitions, not discarding %s", dev);
+        return;
+    }
+    if (!(ext_part_devs[num_ext_part_devs] = strdup(dev))) {
+        ALOGW("Cannot allocate memory, not discarding %s", dev);
+        return;
+    }
+    ++num_ext_part_devs;
+}
+
+/* Discard the free blocks of all the ext filesystems we installed, one
+ * child process per partition so that the devices get trimmed in
+ * parallel. Each child reports back how many bytes it discarded over a
+ * pipe. Failures here are not fatal, the install itself is complete. */
+static void
+discard_ext_parts(void)
+{
+    pid_t pids[MAX_NUM_PARTS];
+    int fds[MAX_NUM_PARTS];
+    uint64_t total = 0;
+    uint64_t discarded;
+    int status;
+    int x;
+
+    for (x = 0; x < num_ext_part_devs; ++x) {
+        int pipefd[2];
+
+        pids[x] = -1;
+        fds[x] = -1;
+        if (pipe(pipefd)) {
+            ALOGE("Cannot create pipe for discard of %s (errno=%d)",
+                 ext_part_devs[x], errno);
+            continue;
+        }
+
+        if ((pids[x] = fork()) < 0) {
+            ALOGE("Cannot fork discard of %s (errno=%d)", ext_part_devs[x],
+                 errno);
+            close(pipefd[0]);
+            close(pipefd[1]);
+            continue;
+        } else if (pids[x] == 0) {
+            close(pipefd[0]);
+            if (discard_ext2_free_blocks(ext_part_devs[x], &discarded))
+                _exit(1);
+            if (write(pipefd[1], &discarded, sizeof(discarded)) !=
+                sizeof(discarded))
+                _exit(1);
+            _exit(0);
+        }
+
+        close(pipefd[1]);
+        fds[x] = pipefd[0];
+    }
+
+    for (x = 0; x < num_ext_part_devs; ++x) {
+        if (pids[x] < 0)
+            continue;
+
+        if (read(fds[x], &discarded, sizeof(discarded)) == sizeof(discarded))
+            total += discarded;
+        close(fds[x]);
+
+        if (waitpid(pids[x], &status, 0) < 0 ||
+            !WIFEXITED(status) || WEXITSTATUS(status))
+            ALOGW("Could not discard free space on %s", ext_part_devs[x]);
+    }
+
+    ALOGI("Discarded %llu MB of free space on %d partitions",
+         (unsigned long long)(total >> 20), num_ext_part_devs);
+
+    for (x = 0; x < num_ext_part_devs; ++x)
+        free(ext_part_devs[x]);
+    num_ext_part_devs = 0;
+}
+
 static int
 process_ext2_image(const char *dst, const char *src, uint32_t flags, int test)
 {
     int rv;
 
-    /* First, write the image to disk. */
-    if (write_raw_image(dst, src, 0, test))
+    /* First, write the image to disk. In sparse mode only the blocks the
+     * image's filesystem actually uses get copied. */
+    if (flags & INSTALL_FLAG_SPARSE) {
+        if (write_ext2_image_sparse(dst, src, test))
+            return 1;
+    } else if (write_raw_image(dst, src, 0, test))
         return 1;
 
     if (test)
@@ -273,6 +376,7 @@ process_image_node(cnode *img, struct disk_info *dinfo, int test)
         sync();
         if (do_fsck(dest_part, 0))
             goto fail;
+        remember_ext_part(dest_part);
         goto done;
     }
 
@@ -296,6 +400,8 @@ process_image_node(cnode *img, struct disk_info *dinfo, int test)
                 flags |= INSTALL_FLAG_RESIZE;
             else if (!strcmp(tmp, "addjournal"))
                 flags |= INSTALL_FLAG_ADDJOURNAL;
+            else if (!strcmp(tmp, "sparse"))
+                flags |= INSTALL_FLAG_SPARSE;
             else {
                 ALOGE("Unknown flag '%s' for image %s", tmp, img->name);
                 free(flagstr_orig);
@@ -337,6 +443,8 @@ process_image_node(cnode *img, struct disk_info *dinfo, int test)
 
     switch(type) {
         case INSTALL_IMAGE_RAW:
+            if (flags & INSTALL_FLAG_SPARSE)
+                ALOGW("sparse flag is meaningless for raw images");
             if (write_raw_image(dinfo->device, filename, offset, test))
                 goto fail;
             break;
@@ -355,6 +463,7 @@ process_image_node(cnode *img, struct disk_info *dinfo, int test)
         case INSTALL_IMAGE_EXT2:
             if (process_ext2_image(dest_part, filename, flags, test))
                 goto fail;
+            remember_ext_part(dest_part);
             break;
 
         default:
@@ -388,7 +497,7 @@ main(int argc, char *argv[])
     int test = 0;
     int x;
 
-    while ((x = getopt (argc, argv, "thdc:l:p:")) != EOF) {
+    while ((x = getopt (argc, argv, "thdDc:l:p:")) != EOF) {
         switch (x) {
             case 'h':
                 return usage();
@@ -407,6 +516,9 @@ main(int argc, char *argv[])
             case 'd':
                 dump = 1;
                 break;
+            case 'D':
+                discard_free_space = 1;
+                break;
             default:
                 fprintf(stderr, "Unknown argument: %c\n", (char)optopt);
                 return usage();
@@ -481,6 +593,12 @@ main(int argc, char *argv[])
     if (apply_disk_config(device_disk_info, test))
         return 1;
 
+    /* Trim whatever the installed filesystems aren't using, so the device
+     * starts out with clean free space. Nothing was written in test mode,
+     * so there is nothing to walk. */
+    if (discard_free_space && !test)
+        discard_ext_parts();
+
     ALOGI("Done processing installer config. Configured %d images", cnt);
     ALOGI("Type 'reboot' or reset to run new image");
     return 0;
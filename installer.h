@@ -31,6 +31,11 @@
 /* flags */
 #define INSTALL_FLAG_RESIZE        0x1
 #define INSTALL_FLAG_ADDJOURNAL    0x2
+#define INSTALL_FLAG_SPARSE        0x4
+
+/* ext2_image.c */
+int write_ext2_image_sparse(const char *dst, const char *src, int test);
+int discard_ext2_free_blocks(const char *dev, uint64_t *discarded);
 
 #endif /* __COMMANDS_SYSLOADER_INSTALLER_INSTALLER_H */
 